@@ -1,12 +1,14 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <ctype.h>
+#include <errno.h>
 #include <curl/curl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <math.h>
 #include <poppler/glib/poppler.h>
 #include <stdio.h>
+#include <unistd.h>
 #define STB_DS_IMPLEMENTATION
 #include "stb/stb_ds.h"
 
@@ -43,6 +45,8 @@ typedef struct {
   gboolean confidently_correct;
   gboolean has_image;
   int image_count;
+  // text was already written to the exam directory and freed
+  gboolean flushed;
 } Question;
 
 typedef enum { UNKNOWN, QUESTION, ANSWER1, ANSWER2, ANSWER3 } TextPart;
@@ -54,24 +58,67 @@ typedef struct {
   gdouble font_size;
 } CharAttribute;
 
+// state of the layout heuristics, carried over between pages
+typedef struct {
+  int question_counter;
+  int question_sum;
+  int answer_counter;
+  int answer_sum;
+  int paragraph_start;
+  TextPart paragraph_mode;
+  gboolean paragraph_started;
+  CharPos paragraph_pos;
+} HeuristicState;
+
+// state of the main loop, enough to continue parsing from next_page
+typedef struct {
+  int next_page;
+  TextPart mode;
+  int current_question;
+  gdouble previous_font_size;
+  int margin_top_y;
+  int margin_bottom_y;
+} ParserState;
+
+// rendered rows of a page, rows band_top to band_top + band_rows are held
+// in surface. band_rows is the page height when the page is held whole.
+typedef struct {
+  PopplerPage *page;
+  int scale;
+  int width;
+  int height;
+  int band_rows;
+  int band_top;
+  cairo_surface_t *surface;
+  // surface was loaded from the raster cache and holds no colors
+  gboolean cached;
+  // NULL without the raster cache and for pages rendered in bands
+  gchar *cache_path;
+} PageRaster;
+
 Question *exam = NULL;
+HeuristicState heuristics = {0};
 
 gboolean is_font_bold(gchar *fontName) {
-  return (g_strstr_len(g_utf8_casefold(fontName, -1), -1,
-                       g_utf8_casefold("bold", -1))) != NULL;
+  gchar *folded = g_utf8_casefold(fontName, -1);
+  gchar *bold = g_utf8_casefold("bold", -1);
+  gboolean status = g_strstr_len(folded, -1, bold) != NULL;
+  g_free(folded);
+  g_free(bold);
+  return status;
 }
 
 gboolean is_answer(int ax) {
   const int THRESHOLD = 5;
-  static int counter = 0;
-  static int sum = 0;
-  if (counter == 0) {
-    sum = ax;
-    counter++;
+  int *counter = &heuristics.answer_counter;
+  int *sum = &heuristics.answer_sum;
+  if (*counter == 0) {
+    *sum = ax;
+    (*counter)++;
     return TRUE;
-  } else if (abs((sum / counter) - ax) < THRESHOLD) {
-    sum += ax;
-    counter++;
+  } else if (abs((*sum / *counter) - ax) < THRESHOLD) {
+    *sum += ax;
+    (*counter)++;
     return TRUE;
   }
   return FALSE;
@@ -79,78 +126,33 @@ gboolean is_answer(int ax) {
 
 gboolean is_question(int qx) {
   const int THRESHOLD = 5;
-  static int counter = 0;
-  static int sum = 0;
-  if (counter == 0) {
-    sum = qx;
-    counter++;
+  int *counter = &heuristics.question_counter;
+  int *sum = &heuristics.question_sum;
+  if (*counter == 0) {
+    *sum = qx;
+    (*counter)++;
     return TRUE;
-  } else if (abs((sum / counter) - qx) < THRESHOLD) {
-    sum += qx;
-    counter++;
+  } else if (abs((*sum / *counter) - qx) < THRESHOLD) {
+    *sum += qx;
+    (*counter)++;
     return TRUE;
   }
   return FALSE;
 }
 
 gboolean is_paragraph_part(int font_size, TextPart m, CharPos *p1) {
-  static int paragraph_start = 0;
-  static TextPart lm = UNKNOWN;
-  static CharPos *lp = NULL;
-  if (lp == NULL || m != lm) {
-    paragraph_start = p1->x1;
-    lm = m;
-    lp = p1;
+  HeuristicState *h = &heuristics;
+  if (!h->paragraph_started || m != h->paragraph_mode) {
+    h->paragraph_start = p1->x1;
+    h->paragraph_mode = m;
+    h->paragraph_pos = *p1;
+    h->paragraph_started = TRUE;
     return TRUE;
   }
-  return ((abs(p1->x1 - paragraph_start) < font_size * 2 && p1->y2 > lp->y2) ||
-          (abs(p1->y2 - lp->y2) < font_size * 4 && p1->x2 > lp->x1));
-}
-
-void save_cropped_region(cairo_surface_t *source_surface, gchar *filename,
-                         int top_y, int bottom_y, int page_width) {
-  cairo_surface_t *crop = cairo_image_surface_create(
-      CAIRO_FORMAT_ARGB32, page_width, bottom_y - top_y);
-  cairo_t *cr = cairo_create(crop);
-  cairo_set_source_surface(cr, source_surface, 0, -top_y);
-  cairo_paint(cr);
-  cairo_destroy(cr);
-  cairo_surface_write_to_png(crop, filename);
-  cairo_surface_destroy(crop);
-}
-
-gboolean is_underlined_answer(cairo_surface_t *surface, CharPos a_pos) {
-  int stride = cairo_image_surface_get_stride(surface);
-  unsigned char *data = cairo_image_surface_get_data(surface);
-  int min_width = (int)((a_pos.x2 - a_pos.x1) * 0.95);
-
-  int y_h = a_pos.y2 - a_pos.y1;
-  for (int y = a_pos.y1; y < a_pos.y2 + y_h / 2; y++) {
-    unsigned char *row = data + (y * stride);
-    int consecutive_black = 0;
-
-    for (int x = a_pos.x1; x < a_pos.x2; x++) {
-      unsigned char *pixel = row + (x * 4); // BGRA
-      unsigned char b = pixel[0];
-      unsigned char g = pixel[1];
-      unsigned char r = pixel[2];
-      int thresh = 200;
-      int is_black = (r < thresh && g < thresh && b < thresh);
-
-      if (is_black) {
-        consecutive_black++;
-      } else {
-        if (consecutive_black >= min_width) {
-          return TRUE;
-        }
-        consecutive_black = 0;
-      }
-    }
-    if (consecutive_black >= min_width) {
-      return TRUE;
-    }
-  }
-  return FALSE;
+  return ((abs(p1->x1 - h->paragraph_start) < font_size * 2 &&
+           p1->y2 > h->paragraph_pos.y2) ||
+          (abs(p1->y2 - h->paragraph_pos.y2) < font_size * 4 &&
+           p1->x2 > h->paragraph_pos.x1));
 }
 
 int sort_characters(const void *a, const void *b) {
@@ -189,39 +191,47 @@ gboolean zip_directory(const gchar *dir_path, const gchar *zip_path,
     return FALSE;
   }
 
+  // any failure leaves an incomplete zip, the caller keeps the checkpoint
+  gboolean status = TRUE;
   const gchar *name;
-  while ((name = g_dir_read_name(dir)) != NULL) {
+  while (status && (name = g_dir_read_name(dir)) != NULL) {
     gchar *filepath = g_build_filename(dir_path, name, NULL);
-    GStatBuf st;
-    if (g_stat(filepath, &st) != 0) {
+    gchar *contents;
+    gsize length;
+    if (!g_file_get_contents(filepath, &contents, &length, error)) {
       g_free(filepath);
-      continue;
+      status = FALSE;
+      break;
     }
 
     struct archive_entry *ae = archive_entry_new();
     gchar *entry_path = g_build_filename("testownikradioamator", name, NULL);
     archive_entry_set_pathname(ae, entry_path);
-    archive_entry_set_size(ae, st.st_size);
+    archive_entry_set_size(ae, length);
     archive_entry_set_filetype(ae, AE_IFREG);
     archive_entry_set_perm(ae, 0644);
-    archive_write_header(a, ae);
-
-    gchar *contents;
-    gsize length;
-    if (g_file_get_contents(filepath, &contents, &length, NULL)) {
-      archive_write_data(a, contents, length);
-      g_free(contents);
+    if (archive_write_header(a, ae) != ARCHIVE_OK ||
+        archive_write_data(a, contents, length) != (la_ssize_t)length) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                  "Failed to add %s to zip: %s", name,
+                  archive_error_string(a));
+      status = FALSE;
     }
 
+    g_free(contents);
     g_free(entry_path);
     archive_entry_free(ae);
     g_free(filepath);
   }
 
   g_dir_close(dir);
-  archive_write_close(a);
+  if (archive_write_close(a) != ARCHIVE_OK && status) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "Failed to finish zip: %s", archive_error_string(a));
+    status = FALSE;
+  }
   archive_write_free(a);
-  return TRUE;
+  return status;
 }
 
 size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
@@ -229,34 +239,21 @@ size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
   return written;
 }
 
-gchar *download_pdf(const gchar *url, GError **error) {
-  const gchar *tmp_dir = g_get_tmp_dir();
-  gchar *template = "radioamatorexamXXXXXX.pdf";
-  gchar *filename = g_build_filename(tmp_dir, template, NULL);
-  gint fd = g_mkstemp(filename);
-  if (fd == -1) {
-    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                "Failed to create temp file");
-    return NULL;
-  }
-  close(fd);
-
+gchar *download_pdf(const gchar *url, const gchar *filename, GError **error) {
   CURL *curl = curl_easy_init();
   if (!curl) {
     g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
                 "Failed to initialize curl");
     g_unlink(filename);
-    g_free(filename);
     return NULL;
   }
 
   FILE *fp = fopen(filename, "wb");
   if (!fp) {
     g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                "Failed to open temp file for writing");
+                "Failed to open %s for writing", filename);
     curl_easy_cleanup(curl);
     g_unlink(filename);
-    g_free(filename);
     return NULL;
   }
 
@@ -272,37 +269,750 @@ gchar *download_pdf(const gchar *url, GError **error) {
     g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Download failed: %s",
                 curl_easy_strerror(res));
     g_unlink(filename);
+    return NULL;
+  }
+
+  return g_filename_to_uri(filename, NULL, error);
+}
+
+// remove a flat directory together with its files
+void remove_directory(const gchar *dir_path) {
+  GDir *dir = g_dir_open(dir_path, 0, NULL);
+  if (!dir) {
+    return;
+  }
+  const gchar *name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    gchar *filepath = g_build_filename(dir_path, name, NULL);
+    g_unlink(filepath);
+    g_free(filepath);
+  }
+  g_dir_close(dir);
+  g_rmdir(dir_path);
+}
+
+// write the question to the exam directory and release its text. questions
+// without a recognized correct answer are dropped. the text is kept if it
+// couldn't be written.
+gboolean export_question(const gchar *exam_dir, Question *q, GError **error) {
+  gboolean status = TRUE;
+  g_strstrip(q->question->str);
+  g_strstrip(q->answer1->str);
+  g_strstrip(q->answer2->str);
+  g_strstrip(q->answer3->str);
+
+  if (q->correct != 0) {
+    gchar *name = g_strdup_printf("%03d.txt", q->number);
+    gchar *filename = g_build_filename(exam_dir, name, NULL);
+
+    char answer_array[4];
+    answer_array[3] = '\0';
+    for (int i = 2; i >= 0; i--) {
+      answer_array[2 - i] = (q->correct & (1 << i)) ? '1' : '0';
+    }
+    gchar *contents;
+    if (q->has_image) {
+      contents = g_strdup_printf("X%s\n[img]%03d.png[/img] %s\n%s\n%s\n%s",
+                                 answer_array, q->number, q->question->str,
+                                 q->answer1->str, q->answer2->str,
+                                 q->answer3->str);
+    } else {
+      contents = g_strdup_printf("X%s\n%s\n%s\n%s\n%s", answer_array,
+                                 q->question->str, q->answer1->str,
+                                 q->answer2->str, q->answer3->str);
+    }
+
+    GError *err = NULL;
+    if (!g_file_set_contents(filename, contents, -1, &err)) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                  "Failed to write the exam question to file %s: %s",
+                  filename, err->message);
+      g_error_free(err);
+      status = FALSE;
+    }
+
+    g_free(name);
     g_free(filename);
+    g_free(contents);
+  }
+  if (!status) {
+    return FALSE;
+  }
+
+  g_string_free(q->question, TRUE);
+  g_string_free(q->answer1, TRUE);
+  g_string_free(q->answer2, TRUE);
+  g_string_free(q->answer3, TRUE);
+  q->question = q->answer1 = q->answer2 = q->answer3 = NULL;
+  q->flushed = TRUE;
+  return TRUE;
+}
+
+// export the questions before index end that weren't written yet, stops at
+// the first question that can't be written
+gboolean flush_questions(const gchar *exam_dir, int end, GError **error) {
+  for (int i = 0; i < end; i++) {
+    if (exam[i].flushed) {
+      continue;
+    }
+    if (!export_question(exam_dir, &exam[i], error)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+// ---------- RASTER CACHE
+
+// rendered pages can be kept on disk so repeated runs over the same pdf, e.g.
+// while tuning the heuristics, skip poppler_page_render. only the brightest
+// channel of every pixel is kept, is_underlined_answer treats a pixel as
+// black when all channels are under its threshold, so any threshold gives
+// the same result as on a fresh render. figures need the colors, they are
+// always rendered from the pdf. rows are run-length encoded as
+// (length, value) byte pairs after a header with the magic and the surface
+// size in host byte order.
+
+#define RASTER_MAGIC "TRC1"
+
+gchar *file_checksum(const gchar *path, GError **error) {
+  GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+  if (!file) {
+    return NULL;
+  }
+  gchar *checksum = g_compute_checksum_for_data(
+      G_CHECKSUM_SHA256, (const guchar *)g_mapped_file_get_contents(file),
+      g_mapped_file_get_length(file));
+  g_mapped_file_unref(file);
+  return checksum;
+}
+
+gchar *raster_cache_path(const gchar *cache_dir, const gchar *pdf_checksum,
+                         int page, int scale) {
+  gchar *name = g_strdup_printf("%s-%04d-%d.raster", pdf_checksum, page,
+                                scale);
+  gchar *path = g_build_filename(cache_dir, name, NULL);
+  g_free(name);
+  return path;
+}
+
+static inline guint8 pixel_brightest(guint32 pixel) {
+  guint8 r = (pixel >> 16) & 0xff;
+  guint8 g = (pixel >> 8) & 0xff;
+  guint8 b = pixel & 0xff;
+  return MAX(r, MAX(g, b));
+}
+
+gboolean save_raster(cairo_surface_t *surface, const gchar *path,
+                     GError **error) {
+  cairo_surface_flush(surface);
+  guint32 width = cairo_image_surface_get_width(surface);
+  guint32 height = cairo_image_surface_get_height(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  unsigned char *data = cairo_image_surface_get_data(surface);
+
+  GByteArray *buf = g_byte_array_new();
+  g_byte_array_append(buf, (const guint8 *)RASTER_MAGIC, 4);
+  g_byte_array_append(buf, (const guint8 *)&width, sizeof(width));
+  g_byte_array_append(buf, (const guint8 *)&height, sizeof(height));
+  for (guint32 y = 0; y < height; y++) {
+    guint32 *row = (guint32 *)(data + y * stride);
+    guint32 x = 0;
+    while (x < width) {
+      guint8 value = pixel_brightest(row[x]);
+      guint8 run = 1;
+      while (x + run < width && run < 255 &&
+             pixel_brightest(row[x + run]) == value) {
+        run++;
+      }
+      guint8 pair[] = {run, value};
+      g_byte_array_append(buf, pair, 2);
+      x += run;
+    }
+  }
+
+  gboolean status =
+      g_file_set_contents(path, (const gchar *)buf->data, buf->len, error);
+  g_byte_array_free(buf, TRUE);
+  return status;
+}
+
+// NULL if the file is missing, corrupted or made for a different page size
+cairo_surface_t *load_raster(const gchar *path, int width, int height) {
+  gchar *contents;
+  gsize length;
+  if (!g_file_get_contents(path, &contents, &length, NULL)) {
+    return NULL;
+  }
+  guint8 *buf = (guint8 *)contents;
+  guint32 header[2];
+  gsize pos = 4 + sizeof(header);
+  if (length < pos || memcmp(buf, RASTER_MAGIC, 4) != 0) {
+    g_free(contents);
+    return NULL;
+  }
+  memcpy(header, buf + 4, sizeof(header));
+  if (header[0] != (guint32)width || header[1] != (guint32)height) {
+    g_free(contents);
+    return NULL;
+  }
+
+  cairo_surface_t *surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  int stride = cairo_image_surface_get_stride(surface);
+  unsigned char *data = cairo_image_surface_get_data(surface);
+  gboolean valid = cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS;
+  for (int y = 0; valid && y < height; y++) {
+    guint32 *row = (guint32 *)(data + y * stride);
+    int x = 0;
+    while (valid && x < width) {
+      if (pos + 2 > length || buf[pos] == 0 || x + buf[pos] > width) {
+        valid = FALSE;
+        break;
+      }
+      guint8 v = buf[pos + 1];
+      guint32 pixel = 0xff000000 | (v << 16) | (v << 8) | v;
+      for (int end = x + buf[pos]; x < end; x++) {
+        row[x] = pixel;
+      }
+      pos += 2;
+    }
+  }
+  g_free(contents);
+
+  if (!valid || pos != length) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+  cairo_surface_mark_dirty(surface);
+  return surface;
+}
+
+// ---------- PAGE RASTER
+
+// the page is rendered on first use, whole or one band at a time when the
+// whole page doesn't fit in the memory budget. a band is the page rendered
+// at the same scale and shifted up by its top row, so its pixels are the
+// same as the rows of the whole page.
+
+cairo_surface_t *render_band(PopplerPage *page, int scale, int width, int top,
+                             int rows) {
+  cairo_surface_t *surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, rows);
+  cairo_t *cr = cairo_create(surface);
+
+  cairo_set_source_rgb(cr, 1, 1, 1);
+  cairo_paint(cr);
+  cairo_translate(cr, 0, -top);
+  cairo_scale(cr, scale, scale);
+  poppler_page_render(page, cr);
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+  return surface;
+}
+
+// pixels of row y of the page. a whole page is read from the raster cache if
+// it's there and written to it after rendering.
+unsigned char *raster_row(PageRaster *raster, int y) {
+  if (!raster->surface || y < raster->band_top ||
+      y >= raster->band_top + raster->band_rows) {
+    g_clear_pointer(&raster->surface, cairo_surface_destroy);
+    raster->cached = FALSE;
+    if (raster->band_rows == raster->height) {
+      raster->band_top = 0;
+      if (raster->cache_path) {
+        raster->surface =
+            load_raster(raster->cache_path, raster->width, raster->height);
+        raster->cached = raster->surface != NULL;
+      }
+      if (!raster->surface) {
+        raster->surface = render_band(raster->page, raster->scale,
+                                      raster->width, 0, raster->height);
+        GError *err = NULL;
+        if (raster->cache_path &&
+            !save_raster(raster->surface, raster->cache_path, &err)) {
+          g_printerr("Failed to cache page %d: %s\n",
+                     poppler_page_get_index(raster->page) + 1, err->message);
+          g_error_free(err);
+        }
+      }
+    } else {
+      // the last band ends at the bottom of the page
+      raster->band_top = MIN(y, raster->height - raster->band_rows);
+      raster->surface =
+          render_band(raster->page, raster->scale, raster->width,
+                      raster->band_top, raster->band_rows);
+    }
+  }
+  int stride = cairo_image_surface_get_stride(raster->surface);
+  unsigned char *data = cairo_image_surface_get_data(raster->surface);
+  return data + (y - raster->band_top) * stride;
+}
+
+void save_cropped_region(PageRaster *raster, gchar *filename, int top_y,
+                         int bottom_y) {
+  if (bottom_y > raster->height)
+    bottom_y = raster->height;
+  if (top_y < 0)
+    top_y = 0;
+  if (bottom_y <= top_y)
+    return;
+  cairo_surface_t *crop;
+  if (raster->surface && !raster->cached &&
+      raster->band_rows == raster->height) {
+    // the crop shares pixel rows with the page instead of copying them
+    int stride = cairo_image_surface_get_stride(raster->surface);
+    unsigned char *data = cairo_image_surface_get_data(raster->surface);
+    crop = cairo_image_surface_create_for_data(
+        data + top_y * stride, CAIRO_FORMAT_ARGB32, raster->width,
+        bottom_y - top_y, stride);
+  } else {
+    // only the cropped rows are rendered, with the colors from the pdf
+    crop = render_band(raster->page, raster->scale, raster->width, top_y,
+                       bottom_y - top_y);
+  }
+  cairo_surface_write_to_png(crop, filename);
+  cairo_surface_destroy(crop);
+}
+
+gboolean is_underlined_answer(PageRaster *raster, CharPos a_pos) {
+  int min_width = (int)((a_pos.x2 - a_pos.x1) * 0.95);
+
+  int y_h = a_pos.y2 - a_pos.y1;
+  for (int y = MAX(a_pos.y1, 0); y < a_pos.y2 + y_h / 2 && y < raster->height;
+       y++) {
+    unsigned char *row = raster_row(raster, y);
+    int consecutive_black = 0;
+
+    for (int x = a_pos.x1; x < a_pos.x2; x++) {
+      unsigned char *pixel = row + (x * 4); // BGRA
+      unsigned char b = pixel[0];
+      unsigned char g = pixel[1];
+      unsigned char r = pixel[2];
+      int thresh = 200;
+      int is_black = (r < thresh && g < thresh && b < thresh);
+
+      if (is_black) {
+        consecutive_black++;
+      } else {
+        if (consecutive_black >= min_width) {
+          return TRUE;
+        }
+        consecutive_black = 0;
+      }
+    }
+    if (consecutive_black >= min_width) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// ---------- MEMORY BUDGET
+
+// parse sizes like 512M or 2G, suffixes are powers of 1024. zero, negative
+// and out of range sizes are rejected.
+gboolean parse_size(const gchar *text, guint64 *size) {
+  // g_ascii_strtoull would accept leading spaces and a minus sign
+  if (!g_ascii_isdigit(*text)) {
+    return FALSE;
+  }
+  gchar *end;
+  errno = 0;
+  guint64 value = g_ascii_strtoull(text, &end, 10);
+  if (errno == ERANGE) {
+    return FALSE;
+  }
+  int shift = 0;
+  switch (g_ascii_toupper(*end)) {
+  case 'K':
+    shift = 10;
+    end++;
+    break;
+  case 'M':
+    shift = 20;
+    end++;
+    break;
+  case 'G':
+    shift = 30;
+    end++;
+    break;
+  }
+  if (g_ascii_toupper(*end) == 'B') {
+    end++;
+  }
+  if (*end != '\0' || value == 0 || value > (G_MAXUINT64 >> shift)) {
+    return FALSE;
+  }
+  *size = value << shift;
+  return TRUE;
+}
+
+// resident set size of the process, 0 if it can't be read
+guint64 current_rss(void) {
+  gchar *contents;
+  if (!g_file_get_contents("/proc/self/statm", &contents, NULL, NULL)) {
+    return 0;
+  }
+  unsigned long size, resident;
+  int fields = sscanf(contents, "%lu %lu", &size, &resident);
+  g_free(contents);
+  if (fields != 2) {
+    return 0;
+  }
+  return (guint64)resident * sysconf(_SC_PAGESIZE);
+}
+
+// bytes of the page text copy in reading order, up to 6 bytes of UTF-8 per
+// character
+#define SORTED_BYTES_PER_CHAR 6
+
+// fewer rows would render the page again for almost every underline check
+#define MIN_BAND_ROWS 64
+
+// rows of the page to render at once so the surface fits in the memory
+// budget next to the text arrays of the page. the text layout, text and
+// attributes from poppler are already counted by the rss, only the arrays
+// allocated after this call are added. a page that doesn't fit is rendered
+// in bands at the same scale, so the output doesn't depend on the budget.
+// a cached page is read into memory as a whole before it's decoded,
+// *cache_path is cleared when the page can't use the raster cache.
+int budget_band_rows(guint64 budget, gchar **cache_path, int page, int width,
+                     int height, guint chars_total) {
+  if (budget == 0) {
+    return height;
+  }
+  guint64 in_use =
+      current_rss() + (guint64)chars_total *
+                          (sizeof(CharPos) + sizeof(CharAttribute) +
+                           sizeof(int) + SORTED_BYTES_PER_CHAR);
+  guint64 stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+  guint64 surface = stride * height;
+  GStatBuf st;
+  if (*cache_path && g_stat(*cache_path, &st) == 0 &&
+      in_use + surface + st.st_size > budget) {
+    g_clear_pointer(cache_path, g_free);
+  }
+  if (in_use + surface <= budget) {
+    return height;
+  }
+
+  g_clear_pointer(cache_path, g_free);
+  guint64 rows = budget > in_use ? (budget - in_use) / stride : 0;
+  if (rows < MIN_BAND_ROWS) {
+    rows = MIN(MIN_BAND_ROWS, height);
+    gchar *needed_str = g_format_size(in_use + stride * rows);
+    gchar *budget_str = g_format_size(budget);
+    g_printerr("Page %d: needs %s for bands of %d rows, over the memory "
+               "budget of %s\n",
+               page + 1, needed_str, (int)rows, budget_str);
+    g_free(needed_str);
+    g_free(budget_str);
+  } else {
+    g_printerr("Page %d: rendered in bands of %d rows to fit the memory "
+               "budget\n",
+               page + 1, (int)rows);
+  }
+  return rows;
+}
+
+// ---------- CHECKPOINT JOURNAL
+
+// the journal is a key file rewritten after every finished page. it holds
+// everything that is needed to continue parsing from state->next_page:
+// the main loop state, the heuristics and the questions found so far.
+// images are already written to the exam directory, the journal only keeps
+// track of their count. text of the questions already written to the exam
+// directory isn't repeated.
+
+void checkpoint_set_pos(GKeyFile *kf, const gchar *group, const gchar *key,
+                        CharPos pos) {
+  gdouble list[] = {pos.index, pos.x1, pos.x2, pos.y1, pos.y2};
+  g_key_file_set_double_list(kf, group, key, list, G_N_ELEMENTS(list));
+}
+
+CharPos checkpoint_get_pos(GKeyFile *kf, const gchar *group,
+                           const gchar *key) {
+  CharPos pos = {0};
+  gsize length = 0;
+  gdouble *list = g_key_file_get_double_list(kf, group, key, &length, NULL);
+  if (list && length == 5) {
+    pos = (CharPos){(int)list[0], list[1], list[2], list[3], list[4]};
+  }
+  g_free(list);
+  return pos;
+}
+
+gboolean save_checkpoint(const gchar *path, const gchar *source,
+                         const gchar *checksum, ParserState *state,
+                         GError **error) {
+  GKeyFile *kf = g_key_file_new();
+
+  g_key_file_set_string(kf, "checkpoint", "source", source);
+  g_key_file_set_string(kf, "checkpoint", "checksum", checksum);
+  g_key_file_set_integer(kf, "checkpoint", "next_page", state->next_page);
+  g_key_file_set_integer(kf, "checkpoint", "mode", state->mode);
+  g_key_file_set_integer(kf, "checkpoint", "current_question",
+                         state->current_question);
+  g_key_file_set_double(kf, "checkpoint", "previous_font_size",
+                        state->previous_font_size);
+  g_key_file_set_integer(kf, "checkpoint", "margin_top_y",
+                         state->margin_top_y);
+  g_key_file_set_integer(kf, "checkpoint", "margin_bottom_y",
+                         state->margin_bottom_y);
+  g_key_file_set_integer(kf, "checkpoint", "questions", arrlen(exam));
+
+  g_key_file_set_integer(kf, "heuristics", "question_counter",
+                         heuristics.question_counter);
+  g_key_file_set_integer(kf, "heuristics", "question_sum",
+                         heuristics.question_sum);
+  g_key_file_set_integer(kf, "heuristics", "answer_counter",
+                         heuristics.answer_counter);
+  g_key_file_set_integer(kf, "heuristics", "answer_sum",
+                         heuristics.answer_sum);
+  g_key_file_set_integer(kf, "heuristics", "paragraph_start",
+                         heuristics.paragraph_start);
+  g_key_file_set_integer(kf, "heuristics", "paragraph_mode",
+                         heuristics.paragraph_mode);
+  g_key_file_set_boolean(kf, "heuristics", "paragraph_started",
+                         heuristics.paragraph_started);
+  checkpoint_set_pos(kf, "heuristics", "paragraph_pos",
+                     heuristics.paragraph_pos);
+
+  for (int i = 0; i < arrlen(exam); i++) {
+    Question q = exam[i];
+    gchar *group = g_strdup_printf("question %d", i);
+    g_key_file_set_integer(kf, group, "number", q.number);
+    checkpoint_set_pos(kf, group, "q_pos", q.q_pos);
+    checkpoint_set_pos(kf, group, "a1_pos", q.a1_pos);
+    checkpoint_set_pos(kf, group, "a2_pos", q.a2_pos);
+    checkpoint_set_pos(kf, group, "a3_pos", q.a3_pos);
+    g_key_file_set_boolean(kf, group, "flushed", q.flushed);
+    if (!q.flushed) {
+      g_key_file_set_string(kf, group, "question", q.question->str);
+      g_key_file_set_string(kf, group, "answer1", q.answer1->str);
+      g_key_file_set_string(kf, group, "answer2", q.answer2->str);
+      g_key_file_set_string(kf, group, "answer3", q.answer3->str);
+    }
+    g_key_file_set_integer(kf, group, "correct", q.correct);
+    g_key_file_set_boolean(kf, group, "confidently_correct",
+                           q.confidently_correct);
+    g_key_file_set_boolean(kf, group, "has_image", q.has_image);
+    g_key_file_set_integer(kf, group, "image_count", q.image_count);
+    g_free(group);
+  }
+
+  // written to a temporary file and renamed, an interrupted save leaves the
+  // previous journal intact
+  gboolean status = g_key_file_save_to_file(kf, path, error);
+  g_key_file_free(kf);
+  return status;
+}
+
+GKeyFile *open_checkpoint(const gchar *path, GError **error) {
+  GKeyFile *kf = g_key_file_new();
+  if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, error)) {
+    g_key_file_free(kf);
     return NULL;
   }
+  return kf;
+}
+
+// a journal is only resumed for the run it was made for, compare one of the
+// keys describing the run with its current value
+gboolean checkpoint_matches(GKeyFile *kf, const gchar *key,
+                            const gchar *expected, GError **error) {
+  gchar *value = g_key_file_get_string(kf, "checkpoint", key, NULL);
+  gboolean status = g_strcmp0(value, expected) == 0;
+  if (!status) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "Checkpoint was made for a different %s: %s", key,
+                value ? value : "(none)");
+  }
+  g_free(value);
+  return status;
+}
+
+// restore the parser state from a journal accepted by checkpoint_matches
+gboolean load_checkpoint(GKeyFile *kf, ParserState *state, GError **error) {
+  int question_total =
+      g_key_file_get_integer(kf, "checkpoint", "questions", NULL);
+  for (int i = 0; i < question_total; i++) {
+    gchar *group = g_strdup_printf("question %d", i);
+    gboolean present = g_key_file_has_group(kf, group);
+    g_free(group);
+    if (!present) {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                  "Checkpoint is missing question %d", i);
+      return FALSE;
+    }
+  }
+
+  state->next_page =
+      g_key_file_get_integer(kf, "checkpoint", "next_page", NULL);
+  state->mode = g_key_file_get_integer(kf, "checkpoint", "mode", NULL);
+  state->current_question =
+      g_key_file_get_integer(kf, "checkpoint", "current_question", NULL);
+  state->previous_font_size =
+      g_key_file_get_double(kf, "checkpoint", "previous_font_size", NULL);
+  state->margin_top_y =
+      g_key_file_get_integer(kf, "checkpoint", "margin_top_y", NULL);
+  state->margin_bottom_y =
+      g_key_file_get_integer(kf, "checkpoint", "margin_bottom_y", NULL);
+
+  heuristics.question_counter =
+      g_key_file_get_integer(kf, "heuristics", "question_counter", NULL);
+  heuristics.question_sum =
+      g_key_file_get_integer(kf, "heuristics", "question_sum", NULL);
+  heuristics.answer_counter =
+      g_key_file_get_integer(kf, "heuristics", "answer_counter", NULL);
+  heuristics.answer_sum =
+      g_key_file_get_integer(kf, "heuristics", "answer_sum", NULL);
+  heuristics.paragraph_start =
+      g_key_file_get_integer(kf, "heuristics", "paragraph_start", NULL);
+  heuristics.paragraph_mode =
+      g_key_file_get_integer(kf, "heuristics", "paragraph_mode", NULL);
+  heuristics.paragraph_started =
+      g_key_file_get_boolean(kf, "heuristics", "paragraph_started", NULL);
+  heuristics.paragraph_pos =
+      checkpoint_get_pos(kf, "heuristics", "paragraph_pos");
+
+  for (int i = 0; i < question_total; i++) {
+    gchar *group = g_strdup_printf("question %d", i);
+    gchar *question = g_key_file_get_string(kf, group, "question", NULL);
+    gchar *answer1 = g_key_file_get_string(kf, group, "answer1", NULL);
+    gchar *answer2 = g_key_file_get_string(kf, group, "answer2", NULL);
+    gchar *answer3 = g_key_file_get_string(kf, group, "answer3", NULL);
+    gboolean flushed = g_key_file_get_boolean(kf, group, "flushed", NULL);
+    arrput(exam,
+           ((Question){g_key_file_get_integer(kf, group, "number", NULL),
+                       checkpoint_get_pos(kf, group, "q_pos"),
+                       checkpoint_get_pos(kf, group, "a1_pos"),
+                       checkpoint_get_pos(kf, group, "a2_pos"),
+                       checkpoint_get_pos(kf, group, "a3_pos"),
+                       flushed ? NULL : g_string_new(question ? question : ""),
+                       flushed ? NULL : g_string_new(answer1 ? answer1 : ""),
+                       flushed ? NULL : g_string_new(answer2 ? answer2 : ""),
+                       flushed ? NULL : g_string_new(answer3 ? answer3 : ""),
+                       g_key_file_get_integer(kf, group, "correct", NULL),
+                       g_key_file_get_boolean(kf, group,
+                                              "confidently_correct", NULL),
+                       g_key_file_get_boolean(kf, group, "has_image", NULL),
+                       g_key_file_get_integer(kf, group, "image_count", NULL),
+                       flushed}));
+    g_free(question);
+    g_free(answer1);
+    g_free(answer2);
+    g_free(answer3);
+    g_free(group);
+  }
 
-  gchar *result = g_strdup_printf("%s%s", "file://", filename);
-  g_free(filename);
-  return result;
+  return TRUE;
 }
 
+gboolean resume = FALSE;
+gchar *max_memory_arg = NULL;
+gchar *raster_cache_dir = NULL;
+
+GOptionEntry entries[] = {
+    {"resume", 'r', 0, G_OPTION_ARG_NONE, &resume,
+     "Continue an interrupted conversion from its last finished page", NULL},
+    {"max-memory", 'm', 0, G_OPTION_ARG_STRING, &max_memory_arg,
+     "Keep the memory usage under SIZE, e.g. 256M", "SIZE"},
+    {"raster-cache", 'c', 0, G_OPTION_ARG_FILENAME, &raster_cache_dir,
+     "Keep rendered pages in DIR and reuse them in later runs", "DIR"},
+    {NULL}};
+
 int main(int argc, char **argv) {
   GError *err = NULL;
+  GOptionContext *context = g_option_context_new("<source> <target>");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &err)) {
+    g_printerr("Error: %s\n", err->message);
+    g_error_free(err);
+    g_option_context_free(context);
+    return 1;
+  }
+  g_option_context_free(context);
   if (argc < 3) {
-    g_printerr("Usage: %s <source> <target>\n", argv[0]);
+    g_printerr("Usage: %s [--resume] [--max-memory SIZE] [--raster-cache DIR] "
+               "<source> <target>\n",
+               argv[0]);
+    return 1;
+  }
+  guint64 max_memory = 0;
+  if (max_memory_arg && !parse_size(max_memory_arg, &max_memory)) {
+    g_printerr("Error: invalid memory size %s\n", max_memory_arg);
     return 1;
   }
   gboolean pdf_is_temp = FALSE;
+  const char *source_arg = argv[1];
   char *source = argv[1];
   const char *target = argv[2];
 
+  if (!g_str_has_prefix(source, "http") && !g_str_has_prefix(source, "file")) {
+    perror("Source should be either http or file schema uri");
+    return 1;
+  }
+
+  // work files are kept next to the target until the zip is written, so an
+  // interrupted conversion can be resumed
+  gchar *target_path = g_canonicalize_filename(target, NULL);
+  gchar *checkpoint_dir = g_strdup_printf("%s.checkpoint", target_path);
+  gchar *journal_path = g_build_filename(checkpoint_dir, "journal", NULL);
+  gchar *pdf_path = g_build_filename(checkpoint_dir, "source.pdf", NULL);
+  char *exam_dir = g_build_filename(checkpoint_dir, "exam", NULL);
+  g_free(target_path);
+
+  if (g_mkdir_with_parents(checkpoint_dir, 0700) != 0) {
+    perror("Failed to create checkpoint directory");
+    return 1;
+  }
+
+  GKeyFile *journal = NULL;
+  if (resume && g_file_test(journal_path, G_FILE_TEST_EXISTS)) {
+    journal = open_checkpoint(journal_path, &err);
+    if (journal && !checkpoint_matches(journal, "source", source_arg, &err)) {
+      g_clear_pointer(&journal, g_key_file_free);
+    }
+    if (!journal) {
+      g_printerr("Cannot resume, starting from the first page: %s\n",
+                 err->message);
+      g_clear_error(&err);
+    }
+  }
+
   if (g_str_has_prefix(source, "http")) {
-    source = download_pdf(source, &err);
     pdf_is_temp = TRUE;
+    // downloaded again on resume, the checksum below tells whether the
+    // remote document changed since the journal was written
+    source = download_pdf(source, pdf_path, &err);
     if (!source) {
       g_printerr("Error: %s\n", err->message);
       g_error_free(err);
       return 1;
     }
-  } else if (!g_str_has_prefix(source, "file")) {
-    perror("Source should be either http or file schema uri");
+  }
+
+  // identifies the document for the journal and the raster cache, a file
+  // source could have been replaced since the journal was written
+  gchar *pdf_checksum = NULL;
+  gchar *pdf_file = g_filename_from_uri(source, NULL, &err);
+  if (pdf_file) {
+    pdf_checksum = file_checksum(pdf_file, &err);
+    g_free(pdf_file);
+  }
+  if (!pdf_checksum) {
+    g_printerr("Error: %s\n", err->message);
+    g_error_free(err);
     return 1;
   }
+  if (journal && !checkpoint_matches(journal, "checksum", pdf_checksum, &err)) {
+    g_printerr("Cannot resume, starting from the first page: %s\n",
+               err->message);
+    g_clear_error(&err);
+    g_clear_pointer(&journal, g_key_file_free);
+  }
 
   PopplerDocument *doc = poppler_document_new_from_file(source, NULL, &err);
   if (!doc) {
@@ -311,23 +1021,44 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  const gchar *tmp_dir = g_get_tmp_dir();
-  char *exam_dir =
-      g_mkdtemp(g_build_filename(tmp_dir, "testownikradioamatorXXXXXX", NULL));
-  if (exam_dir == NULL) {
-    perror("Failed to create temporary exam directory");
+  ParserState state = {0, UNKNOWN, 1, 0, INT32_MAX, 0};
+  gboolean resumed = FALSE;
+  if (journal) {
+    resumed = load_checkpoint(journal, &state, &err);
+    if (!resumed) {
+      g_printerr("Cannot resume, starting from the first page: %s\n",
+                 err->message);
+      g_clear_error(&err);
+    }
+    g_key_file_free(journal);
+  }
+  if (!resumed) {
+    remove_directory(exam_dir);
+    g_unlink(journal_path);
+    if (!pdf_is_temp) {
+      g_unlink(pdf_path);
+    }
+  }
+  if (g_mkdir_with_parents(exam_dir, 0700) != 0) {
+    perror("Failed to create exam directory");
     return 1;
   }
 
-  TextPart mode = UNKNOWN;
   int page_count = poppler_document_get_n_pages(doc);
-  int current_question = 1;
-  gdouble previous_font_size = 0;
+  if (resumed) {
+    g_printerr("Resuming from page %d of %d\n", state.next_page + 1,
+               page_count);
+  }
 
-  int margin_top_y = INT32_MAX;
-  int margin_bottom_y = 0;
+  gboolean raster_cache = raster_cache_dir != NULL;
+  if (raster_cache && g_mkdir_with_parents(raster_cache_dir, 0755) != 0) {
+    g_printerr("Raster cache disabled: failed to create %s\n",
+               raster_cache_dir);
+    raster_cache = FALSE;
+  }
 
-  for (int p = 0; p < page_count; p++) {
+  gboolean export_status = TRUE;
+  for (int p = state.next_page; p < page_count; p++) {
     PopplerPage *page = poppler_document_get_page(doc, p);
 
     PopplerRectangle *rectangles;
@@ -345,17 +1076,16 @@ int main(int argc, char **argv) {
     double page_width, page_height;
     poppler_page_get_size(page, &page_width, &page_height);
 
-    double render_scale = 3;
-    cairo_surface_t *surface = cairo_image_surface_create(
-        CAIRO_FORMAT_ARGB32, (int)(page_width * render_scale),
-        (int)(page_height * render_scale));
-    cairo_t *cr = cairo_create(surface);
-
-    cairo_set_source_rgb(cr, 1, 1, 1);
-    cairo_paint(cr);
-    cairo_scale(cr, render_scale, render_scale);
-    poppler_page_render(page, cr);
-    cairo_destroy(cr);
+    int render_scale = 3;
+    PageRaster raster = {page, render_scale, (int)(page_width * render_scale),
+                         (int)(page_height * render_scale)};
+    if (raster_cache) {
+      raster.cache_path =
+          raster_cache_path(raster_cache_dir, pdf_checksum, p, render_scale);
+    }
+    raster.band_rows = budget_band_rows(max_memory, &raster.cache_path, p,
+                                        raster.width, raster.height,
+                                        chars_total);
 
     // ---------- SORT THE TEXT AND ATTRIBUTES
 
@@ -392,9 +1122,10 @@ int main(int argc, char **argv) {
     // break down attributes to single characters
     for (GList *l = attrs; l; l = l->next) {
       PopplerTextAttributes *a = l->data;
+      gboolean is_bold = is_font_bold(a->font_name);
       for (int i = a->start_index; i < a->end_index + 1; i++) {
         attributes[i].index = i;
-        attributes[i].is_bold = is_font_bold(a->font_name);
+        attributes[i].is_bold = is_bold;
         attributes[i].is_underlined = a->is_underlined;
         attributes[i].font_size = a->font_size;
       }
@@ -418,18 +1149,18 @@ int main(int argc, char **argv) {
     gchar *gc = sorted->str;
     int ignore = 0;
     for (int i = 0; i < chars_total; i++) {
-      if (positions[i].y2 < margin_top_y)
-        margin_top_y = positions[i].y2;
-      if (positions[i].y2 > margin_bottom_y)
-        margin_bottom_y = positions[i].y2;
+      if (positions[i].y2 < state.margin_top_y)
+        state.margin_top_y = positions[i].y2;
+      if (positions[i].y2 > state.margin_bottom_y)
+        state.margin_bottom_y = positions[i].y2;
 
-      if (previous_font_size < attributes[i].font_size &&
-          attributes[i].is_bold && mode == ANSWER3) {
+      if (state.previous_font_size < attributes[i].font_size &&
+          attributes[i].is_bold && state.mode == ANSWER3) {
         // change of category
-        current_question = 1;
-        mode = UNKNOWN;
+        state.current_question = 1;
+        state.mode = UNKNOWN;
       }
-      gchar *qp = g_strdup_printf("%d.", current_question);
+      gchar *qp = g_strdup_printf("%d.", state.current_question);
 
       gunichar c = g_utf8_get_char(gc);
       if (c == '\n')
@@ -441,25 +1172,26 @@ int main(int argc, char **argv) {
         arrput(exam, ((Question){arrlen(exam), positions[i], positions[i],
                                  positions[i], positions[i], g_string_new(""),
                                  g_string_new(""), g_string_new(""),
-                                 g_string_new(""), 0, FALSE, FALSE, 0}));
-        ignore = (int)log10(current_question) + 2;
+                                 g_string_new(""), 0, FALSE, FALSE, 0,
+                                 FALSE}));
+        ignore = (int)log10(state.current_question) + 2;
         exam[arrlen(exam) - 1].q_pos.y1 = positions[i].y2;
-        mode = QUESTION;
-        current_question++;
+        state.mode = QUESTION;
+        state.current_question++;
       } else if ((g_str_has_prefix(gc, "a.") || g_str_has_prefix(gc, "A.")) &&
-                 mode == QUESTION && is_answer(positions[i].x1)) {
+                 state.mode == QUESTION && is_answer(positions[i].x1)) {
         ignore = 2;
-        mode = ANSWER1;
+        state.mode = ANSWER1;
         exam[arrlen(exam) - 1].a1_pos = positions[i + 3];
       } else if ((g_str_has_prefix(gc, "b.") || g_str_has_prefix(gc, "B.")) &&
-                 mode == ANSWER1 && is_answer(positions[i].x1)) {
+                 state.mode == ANSWER1 && is_answer(positions[i].x1)) {
         ignore = 2;
-        mode = ANSWER2;
+        state.mode = ANSWER2;
         exam[arrlen(exam) - 1].a2_pos = positions[i + 3];
       } else if ((g_str_has_prefix(gc, "c.") || g_str_has_prefix(gc, "C.")) &&
-                 mode == ANSWER2 && is_answer(positions[i].x1)) {
+                 state.mode == ANSWER2 && is_answer(positions[i].x1)) {
         ignore = 2;
-        mode = ANSWER3;
+        state.mode = ANSWER3;
         exam[arrlen(exam) - 1].a3_pos = positions[i + 3];
       }
 
@@ -467,9 +1199,10 @@ int main(int argc, char **argv) {
         ignore--;
       } else if (arrlen(exam) > 0) {
         int qi = arrlen(exam) - 1;
-        switch (mode) {
+        switch (state.mode) {
         case QUESTION:
-          if (is_paragraph_part(attributes[i].font_size, mode, &positions[i])) {
+          if (is_paragraph_part(attributes[i].font_size, state.mode,
+                                &positions[i])) {
             g_string_append_len(exam[qi].question, cbuf, clen);
             exam[qi].q_pos.y2 = positions[i].y2;
           }
@@ -479,7 +1212,8 @@ int main(int argc, char **argv) {
             exam[qi].correct = 0b100;
             exam[qi].confidently_correct = TRUE;
           }
-          if (is_paragraph_part(attributes[i].font_size, mode, &positions[i])) {
+          if (is_paragraph_part(attributes[i].font_size, state.mode,
+                                &positions[i])) {
             g_string_append_len(exam[qi].answer1, cbuf, clen);
             if (exam[qi].a1_pos.y2 == positions[i].y2) {
               exam[qi].a1_pos.x2 = positions[i].x2;
@@ -490,7 +1224,7 @@ int main(int argc, char **argv) {
               if (!exam[qi].confidently_correct &&
                   strlen(exam[qi].answer1->str) > 3 &&
                   is_underlined_answer(
-                      surface, pos_scaled(exam[qi].a1_pos, render_scale))) {
+                      &raster, pos_scaled(exam[qi].a1_pos, render_scale))) {
                 exam[qi].correct = 0b100;
               }
             }
@@ -501,7 +1235,8 @@ int main(int argc, char **argv) {
             exam[qi].correct = 0b010;
             exam[qi].confidently_correct = TRUE;
           }
-          if (is_paragraph_part(attributes[i].font_size, mode, &positions[i])) {
+          if (is_paragraph_part(attributes[i].font_size, state.mode,
+                                &positions[i])) {
             g_string_append_len(exam[qi].answer2, cbuf, clen);
             if (exam[qi].a2_pos.y2 == positions[i].y2) {
               exam[qi].a2_pos.x2 = positions[i].x2;
@@ -509,7 +1244,7 @@ int main(int argc, char **argv) {
               if (!exam[qi].confidently_correct &&
                   strlen(exam[qi].answer2->str) > 3 &&
                   is_underlined_answer(
-                      surface, pos_scaled(exam[qi].a2_pos, render_scale))) {
+                      &raster, pos_scaled(exam[qi].a2_pos, render_scale))) {
                 exam[qi].correct = 0b010;
               }
             }
@@ -520,7 +1255,8 @@ int main(int argc, char **argv) {
             exam[qi].correct = 0b001;
             exam[qi].confidently_correct = TRUE;
           }
-          if (is_paragraph_part(attributes[i].font_size, mode, &positions[i])) {
+          if (is_paragraph_part(attributes[i].font_size, state.mode,
+                                &positions[i])) {
             g_string_append_len(exam[qi].answer3, cbuf, clen);
             if (exam[qi].a3_pos.y2 == positions[i].y2) {
               exam[qi].a3_pos.x2 = positions[i].x2;
@@ -528,7 +1264,7 @@ int main(int argc, char **argv) {
               if (!exam[qi].confidently_correct &&
                   strlen(exam[qi].answer3->str) > 3 &&
                   is_underlined_answer(
-                      surface, pos_scaled(exam[qi].a3_pos, render_scale))) {
+                      &raster, pos_scaled(exam[qi].a3_pos, render_scale))) {
                 exam[qi].correct = 0b001;
               }
             }
@@ -540,7 +1276,7 @@ int main(int argc, char **argv) {
 
       g_free(qp);
       gc = g_utf8_next_char(gc);
-      previous_font_size = attributes[i].font_size;
+      state.previous_font_size = attributes[i].font_size;
     }
 
     // ---------- ITERATE THROUGH / EXPORT IMAGES
@@ -590,42 +1326,41 @@ int main(int argc, char **argv) {
       if (!q.has_image) {
         if (i == page_first_qi - 1) {
           if (exam[i].q_pos.y2 > exam[i].a1_pos.y2 &&
-              exam[i].a1_pos.y2 - margin_top_y > previous_font_size * 3) {
+              exam[i].a1_pos.y2 - state.margin_top_y >
+                  state.previous_font_size * 3) {
             exam[i].has_image = TRUE;
             exam[i].image_count++;
             gchar *name = g_strdup_printf("%03d.png", exam[i].number);
             gchar *filename = g_build_filename(exam_dir, name, NULL);
-            save_cropped_region(surface, filename, margin_top_y * render_scale,
-                                q.a1_pos.y1 * render_scale,
-                                (int)page_width * render_scale);
+            save_cropped_region(&raster, filename,
+                                state.margin_top_y * render_scale,
+                                q.a1_pos.y1 * render_scale);
             g_free(filename);
             g_free(name);
           } else if (exam[i].q_pos.y2 > exam[i].a1_pos.y2 &&
-                     margin_bottom_y - exam[i].q_pos.y2 >
-                         previous_font_size * 3) {
+                     state.margin_bottom_y - exam[i].q_pos.y2 >
+                         state.previous_font_size * 3) {
             exam[i].has_image = TRUE;
           }
         } else if (q.q_pos.y2 < q.a1_pos.y2 &&
-                   q.a1_pos.y2 - q.q_pos.y2 > previous_font_size * 3) {
+                   q.a1_pos.y2 - q.q_pos.y2 > state.previous_font_size * 3) {
           exam[i].has_image = TRUE;
           exam[i].image_count++;
           gchar *name = g_strdup_printf("%03d.png", q.number);
           gchar *filename = g_build_filename(exam_dir, name, NULL);
-          save_cropped_region(surface, filename, q.q_pos.y1 * render_scale,
-                              q.a1_pos.y1 * render_scale,
-                              (int)page_width * render_scale);
+          save_cropped_region(&raster, filename, q.q_pos.y1 * render_scale,
+                              q.a1_pos.y1 * render_scale);
           g_free(filename);
           g_free(name);
         } else if (i == arrlen(exam) - 1 &&
                    exam[i].q_pos.y2 > exam[i].a1_pos.y2 &&
-                   margin_bottom_y - exam[i].q_pos.y2 >
-                       previous_font_size * 3) {
+                   state.margin_bottom_y - exam[i].q_pos.y2 >
+                       state.previous_font_size * 3) {
           exam[i].image_count++;
           gchar *name = g_strdup_printf("%03d.png", exam[i].number);
           gchar *filename = g_build_filename(exam_dir, name, NULL);
-          save_cropped_region(surface, filename, q.q_pos.y1 * render_scale,
-                              margin_bottom_y * render_scale,
-                              (int)page_width * render_scale);
+          save_cropped_region(&raster, filename, q.q_pos.y1 * render_scale,
+                              state.margin_bottom_y * render_scale);
           g_free(filename);
           g_free(name);
         }
@@ -635,98 +1370,83 @@ int main(int argc, char **argv) {
     free(attributes);
     free(positions);
     free(reverse_index_map);
+    g_string_free(sorted, TRUE);
     g_free(rectangles);
 
-    cairo_surface_destroy(surface);
+    g_clear_pointer(&raster.surface, cairo_surface_destroy);
+    g_free(raster.cache_path);
 
     poppler_page_free_image_mapping(image_mapping);
     poppler_page_free_text_attributes(attrs);
     g_free(text);
     g_object_unref(page);
-  }
-  g_object_unref(doc);
-
-  if (pdf_is_temp) {
-    gchar *path = g_filename_from_uri(source, NULL, NULL);
-    g_unlink(path);
-    g_free(path);
-    g_free(source);
-  }
-
-  // ---------- EXPORT QUESTIONS
 
-  char answer_array[4];
-  answer_array[3] = '\0';
-  for (int i = 0; i < arrlen(exam); i++) {
-    Question q = exam[i];
-    g_strstrip(q.question->str);
-    g_strstrip(q.answer1->str);
-    g_strstrip(q.answer2->str);
-    g_strstrip(q.answer3->str);
-    if (q.correct == 0) {
-      continue;
+    // only the last question can still be changed by the following pages.
+    // the journal isn't advanced past questions that weren't written.
+    if (!flush_questions(exam_dir, arrlen(exam) - 1, &err)) {
+      g_printerr("Error: %s\n", err->message);
+      g_clear_error(&err);
+      export_status = FALSE;
+      break;
     }
-    gchar *name = g_strdup_printf("%03d.txt", q.number);
-    gchar *filename = g_build_filename(exam_dir, name, NULL);
 
-    for (int i = 2; i >= 0; i--) {
-      answer_array[2 - i] = (q.correct & (1 << i)) ? '1' : '0';
-    }
-    gchar *contents;
-    if (q.has_image) {
-      contents = g_strdup_printf(
-          "X%s\n[img]%03d.png[/img] %s\n%s\n%s\n%s", answer_array, q.number,
-          q.question->str, q.answer1->str, q.answer2->str, q.answer3->str);
-    } else {
-      contents =
-          g_strdup_printf("X%s\n%s\n%s\n%s\n%s", answer_array, q.question->str,
-                          q.answer1->str, q.answer2->str, q.answer3->str);
+    state.next_page = p + 1;
+    if (!save_checkpoint(journal_path, source_arg, pdf_checksum, &state,
+                         &err)) {
+      g_printerr("Failed to write the checkpoint journal %s: %s\n",
+                 journal_path, err->message);
+      g_clear_error(&err);
     }
+  }
+  g_object_unref(doc);
 
-    if (!g_file_set_contents(filename, contents, -1, &err)) {
-      g_printerr("Failed to write the exam question to file %s: %s\n", filename,
-                 err->message);
-      g_error_free(err);
-      break;
-    }
+  // ---------- EXPORT QUESTIONS
 
-    g_free(name);
-    g_free(filename);
-    g_free(contents);
+  if (export_status && !flush_questions(exam_dir, arrlen(exam), &err)) {
+    g_printerr("Error: %s\n", err->message);
+    g_clear_error(&err);
+    export_status = FALSE;
   }
 
-  gboolean zip_status = zip_directory(exam_dir, target, &err);
-  if (!zip_status) {
-    g_printerr("Error: %s\n", err->message);
-    g_error_free(err);
+  gboolean zip_status = export_status;
+  if (zip_status) {
+    zip_status = zip_directory(exam_dir, target, &err);
+    if (!zip_status) {
+      g_printerr("Error: %s\n", err->message);
+      g_error_free(err);
+    }
   }
 
-  // ---------- CLEAR TEMP DIR
+  // ---------- CLEAR WORK FILES
 
   for (int i = 0; i < arrlen(exam); i++) {
-    Question q = exam[i];
-    gchar *name = g_strdup_printf("%03d.txt", q.number);
-    gchar *filename = g_build_filename(exam_dir, name, NULL);
-
-    if (q.image_count > 0) {
-      gchar *name = g_strdup_printf("%03d.png", q.number);
-      gchar *filename = g_build_filename(exam_dir, name, NULL);
-      g_unlink(filename);
-      g_free(name);
-      g_free(filename);
+    if (!exam[i].flushed) {
+      g_string_free(exam[i].question, TRUE);
+      g_string_free(exam[i].answer1, TRUE);
+      g_string_free(exam[i].answer2, TRUE);
+      g_string_free(exam[i].answer3, TRUE);
     }
-
-    g_string_free(q.question, TRUE);
-    g_string_free(q.answer1, TRUE);
-    g_string_free(q.answer2, TRUE);
-    g_string_free(q.answer3, TRUE);
-    g_unlink(filename);
-    g_free(name);
-    g_free(filename);
   }
-
   arrfree(exam);
-  g_rmdir(exam_dir);
+  g_free(pdf_checksum);
+
+  // keep the checkpoint if the questions or the zip could not be written,
+  // --resume retries from the last saved page.
+  // the exit status tells the caller that the leftover directory isn't a
+  // finished conversion.
+  if (zip_status) {
+    remove_directory(exam_dir);
+    g_unlink(journal_path);
+    g_unlink(pdf_path);
+    g_rmdir(checkpoint_dir);
+  }
+
+  if (pdf_is_temp) {
+    g_free(source);
+  }
   g_free(exam_dir);
-  return 0;
+  g_free(pdf_path);
+  g_free(journal_path);
+  g_free(checkpoint_dir);
+  return zip_status ? 0 : 1;
 }
@@ -8,5 +8,5 @@ for key in $(yq -rM 'keys | .[]' categories.yaml); do
   val=$(yq -rM ".${key}" categories.yaml)
   
   echo "Parsing exam ${key}..."
-  ./exam "$val" "out/${key}.zip"
+  ./exam --resume "$val" "out/${key}.zip"
 done